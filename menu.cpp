@@ -16,9 +16,29 @@
 #include <cstdlib>
 #include <limits>
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
 
 namespace fs = std::filesystem;
 
+// Header of the output/<name>.bin files written by EXPORT_BIN (layout must
+// match BinHeader in main.cpp; all fields little-endian)
+struct BinHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t n_points;
+    double   v_free;
+    double   k_jam;
+    double   q_max;
+    double   k_opt;
+    uint64_t k_offset;
+    uint64_t v_offset;
+    uint64_t q_offset;
+    uint8_t  reserved[48];
+};
+static_assert(sizeof(BinHeader) == 128, "BinHeader layout");
+
 // Function declarations
 void clearScreen();
 void showHeader();
@@ -30,6 +50,8 @@ bool runAnalysis(const std::string& inputFile, const std::string& scenarioName);
 void showPlotForFile(const std::string& csvName);
 void showSummaryAndContinue(const std::string& scenarioName);
 void printLine(char ch = '=', int length = 50);
+bool readBinarySummary(const std::string& path, BinHeader& header);
+bool binaryIsCurrent(const std::string& scenarioName);
 
 int main() {
     // Create directories
@@ -42,7 +64,7 @@ int main() {
         std::cout << "\n";
         printLine('-');
         std::cout << "  WARNING: traffic_dsl.exe not found!\n";
-        std::cout << "  To compile: g++ -std=c++17 -Wall -O2 main.cpp -o traffic_dsl.exe\n";
+        std::cout << "  To compile: g++ -std=c++17 -Wall -O2 -pthread main.cpp -o traffic_dsl.exe\n";
         printLine('-');
         std::cout << "\nPress Enter to continue...";
         std::string dummy;
@@ -238,6 +260,7 @@ void createScenario() {
     fout << "COMPUTE_FLOW\n";
     fout << "CAPACITY\n";
     fout << "EXPORT_CSV       " << scenarioName << "\n";
+    fout << "EXPORT_BIN       " << scenarioName << "\n";
     fout << "PRINT_RESULTS\n";
     
     fout.close();
@@ -389,6 +412,9 @@ void showSummaryAndContinue(const std::string& scenarioName) {
     // Show files created
     std::cout << "\n  Generated Files:\n";
     std::cout << "    - output/" << scenarioName << ".csv\n";
+    const bool useBin = binaryIsCurrent(scenarioName);
+    if (useBin)
+        std::cout << "    - output/" << scenarioName << ".bin\n";
     
     // Check if plot exists or generate it
     std::string plotFile = "output/" + scenarioName + "_plot.png";
@@ -399,9 +425,21 @@ void showSummaryAndContinue(const std::string& scenarioName) {
         std::cout << "    - output/" << scenarioName << "_plot.png\n";
     }
     
-    // Read and display summary from CSV
+    // Read summary from the binary header when there is one, else from CSV
+    std::string binPath = "output/" + scenarioName + ".bin";
     std::string csvPath = "output/" + scenarioName + ".csv";
-    if (fs::exists(csvPath)) {
+    BinHeader header;
+    if (useBin && readBinarySummary(binPath, header)) {
+        std::cout << "\n";
+        printLine('-');
+        std::cout << "  Summary:\n";
+        std::cout << "    - Data points: " << header.n_points << "\n";
+        std::cout << "    - Max flow: " << std::fixed << std::setprecision(0)
+                  << header.q_max << " veh/h\n";
+        std::cout << "    - Opt density: " << std::fixed << std::setprecision(1)
+                  << header.k_opt << " veh/km\n";
+    }
+    else if (fs::exists(csvPath)) {
         try {
             std::ifstream csv(csvPath);
             std::string line;
@@ -452,4 +490,26 @@ void showSummaryAndContinue(const std::string& scenarioName) {
     std::cout << "\n  Press Enter to return to menu...";
     std::string dummy;
     std::getline(std::cin, dummy);
-}
\ No newline at end of file
+}
+
+bool readBinarySummary(const std::string& path, BinHeader& header) {
+    // Headers are little-endian; big-endian hosts fall back to the CSV
+    const uint16_t probe = 1;
+    if (*reinterpret_cast<const unsigned char*>(&probe) != 1) return false;
+
+    std::ifstream bin(path, std::ios::binary);
+    if (!bin.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+
+    static const char magic[8] = {'T', 'R', 'A', 'F', 'B', 'I', 'N', '\0'};
+    return std::memcmp(header.magic, magic, sizeof(magic)) == 0 && header.version == 1;
+}
+
+// A .bin left over from an earlier EXPORT_BIN run must not stand in for a
+// newer CSV, so it only counts when it is at least as new as the CSV
+bool binaryIsCurrent(const std::string& scenarioName) {
+    std::error_code ec;
+    const auto binTime = fs::last_write_time("output/" + scenarioName + ".bin", ec);
+    if (ec) return false;
+    const auto csvTime = fs::last_write_time("output/" + scenarioName + ".csv", ec);
+    return ec || binTime >= csvTime;
+}